@@ -3,8 +3,6 @@
 
 #include "picosystem_hardware.h"
 
-extern struct picosystem_hw pshw;
-
 int main() 
 {
   // const uint led_pin = 25;
@@ -37,12 +35,17 @@ int main()
 
   pshw.io = picosystem_gpio_get();
 
+  picosystem_ctx_t *ctx = picosystem_screen_ctx();
   color_t c = picosystem_rgb(15, 15, 15, 15);
   uint32_t x = 0;
   uint32_t y = 0;
   uint32_t v = 1;
   uint32_t elapse = 0;
 
+  // the screen refreshes at ~40hz (FRCTRL2 0x1E), let the governor pick
+  // the slowest clock that keeps rendering within that budget
+  picosystem_governor_enable(25000, 3);
+
   // Loop forever
   while (true) {
     uint32_t start_tick_us = picosystem_time_us();
@@ -51,6 +54,7 @@ int main()
     pshw.io = picosystem_gpio_get();
 
     while(picosystem_is_flipping()) {}
+    uint32_t render_start_us = picosystem_time_us();
 
 #if 0
     // Blink LED
@@ -64,8 +68,8 @@ int main()
     sleep_ms(1000);
     // led_pin = (led_pin + 1) % 3;
 #else
-    picosystem_clear(0);
-    picosystem_draw_line(NULL, x, 0, PICOSYSTEM_SCREEN_WIDTH - x - 1, PICOSYSTEM_SCREEN_HEIGHT - 1, c); 
+    picosystem_clear(ctx, 0);
+    picosystem_draw_line(ctx, x, 0, PICOSYSTEM_SCREEN_WIDTH - x - 1, PICOSYSTEM_SCREEN_HEIGHT - 1, c); 
     x += v;
     if ((x >= PICOSYSTEM_SCREEN_WIDTH) || (x <= 0)) {
       v = -v;
@@ -73,6 +77,7 @@ int main()
     }
     picosystem_flip();
     uint32_t end_tick_us = picosystem_time_us();
+    picosystem_governor_frame(end_tick_us - render_start_us);
     elapse += end_tick_us - start_tick_us;
     if (x % 8 == 0) {
       printf("elapse: %d\r\n", elapse >> 3);
@@ -4,95 +4,201 @@
 
 #include "picosystem_hardware.h"
 
-extern struct picosystem_hw pshw;
-
 color_t picosystem_rgb(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
   // color_t will contain pixel data in the format aaaarrrrggggbbbb
   return (r & 0xf) | ((a & 0xf) << 4) | ((b & 0xf) << 8) | ((g & 0xf) << 12);
 }
 
-// clear screen
-void picosystem_clear(color_t c) {
-  color_t *dst = pshw.screen->data;
-  for (int32_t y = 0; y < PICOSYSTEM_SCREEN_HEIGHT; y++) {
-    for (int32_t x = 0; x < PICOSYSTEM_SCREEN_WIDTH; x++) {
-      *dst++ = c;
-    }
-  }
+// bind a context to a target buffer with the clip rect covering the whole
+// buffer and blending disabled
+void picosystem_ctx_init(picosystem_ctx_t *ctx, buffer_t *target) {
+  ctx->target = target;
+  ctx->cx = 0;
+  ctx->cy = 0;
+  ctx->cw = target->w;
+  ctx->ch = target->h;
+  ctx->blend = PICOSYSTEM_BLEND_COPY;
+  ctx->alpha = 15;
+}
+
+// set the clip rect, clamped to the bounds of the target buffer
+void picosystem_ctx_clip(picosystem_ctx_t *ctx, int32_t x, int32_t y, int32_t w, int32_t h) {
+  int32_t x2 = x + w, y2 = y + h;
+  if (x < 0) x = 0;
+  if (y < 0) y = 0;
+  if (x2 > ctx->target->w) x2 = ctx->target->w;
+  if (y2 > ctx->target->h) y2 = ctx->target->h;
+  ctx->cx = x;
+  ctx->cy = y;
+  ctx->cw = x2 > x ? x2 - x : 0;
+  ctx->ch = y2 > y ? y2 - y : 0;
 }
 
+void picosystem_ctx_blend(picosystem_ctx_t *ctx, uint8_t blend, uint8_t alpha) {
+  ctx->blend = blend;
+  ctx->alpha = alpha > 15 ? 15 : alpha;
+}
 
-// #define write_pixel(x, y) dst[x + y * SCREEN_WIDTH] = color; 
+// mix src over dst using the source alpha scaled by the context alpha. the
+// destination alpha is preserved.
+color_t picosystem_blend_pixel(color_t dst, color_t src, uint8_t alpha) {
+  uint32_t a = ((src >> 4) & 0xf) * alpha; // 0..225
+  a = (a + (a >> 4) + 1) >> 4;             // 0..15
+  a += a >> 3;                             // 0..16
+  if (a == 0) return dst;
+  if (a == 16) return (src & 0xff0f) | (dst & 0x00f0);
 
-inline void picosystem_write_pixel(int32_t x, int32_t y, color_t c) {
-  color_t *dst = pshw.screen->data;
-  dst[x + y * PICOSYSTEM_SCREEN_WIDTH] = c;
+  // red and blue lanes are 8 bits apart so they can be mixed in one multiply
+  // without carrying into each other
+  uint32_t rb = (((src & 0x0f0f) * a + (dst & 0x0f0f) * (16 - a)) >> 4) & 0x0f0f;
+  uint32_t g = (((src >> 12) * a + (dst >> 12) * (16 - a)) >> 4) << 12;
+  return rb | g | (dst & 0x00f0);
 }
 
-void picosystem_draw_line(color_t *fb, int32_t x1, int32_t y1, int32_t x2, int32_t y2, color_t color)
-{
-  bool yLonger = false;
-  int shortLen = y2 - y1;
-  int longLen = x2 - x1;
-  int decInc;
-  color_t *dst;
-
-  if (fb == NULL) {
-    dst = pshw.screen->data;
-  } else {
-    dst = fb;
-  }
+// clear the clip rect of the context
+void picosystem_clear(picosystem_ctx_t *ctx, color_t c) {
+  int32_t stride = ctx->target->w;
+  color_t *row = ctx->target->data + ctx->cx + ctx->cy * stride;
+  int32_t w = ctx->cw, h = ctx->ch;
 
-#if 1
-  if ((shortLen ^ (shortLen >> 31)) - (shortLen >> 31) > (longLen ^ (longLen >> 31)) - (longLen >> 31)) {
-    shortLen ^= longLen;
-    longLen ^= shortLen;
-    shortLen ^= longLen;
-    yLonger = true;
-  }
-#else
-  if (abs(shortLen) > abs(longLen)) {
-    int swap = shortLen;
-    shortLen = longLen;
-    longLen = swap;
-    yLonger = true;
-  }
-#endif
-  if (longLen == 0) decInc = 0;
-  else decInc = (shortLen << 16) / longLen;
-
-  if (yLonger) {
-    if (longLen > 0) {
-      longLen += y1;
-      for (int j = 0x8000 + (x1 << 16); y1 <= longLen; ++y1) {
-        //fb[(j >> 16) + THUMBY_SCREEN_WIDTH * y1] = color;
-        picosystem_write_pixel((j >> 16), y1, color);
-        j+= decInc;
+  if (ctx->blend == PICOSYSTEM_BLEND_COPY) {
+    if (w == stride) {
+      // clip covers full rows, fill as one contiguous span
+      color_t *dst = row;
+      for (int32_t i = w * h; i > 0; i--) {
+        *dst++ = c;
       }
       return;
     }
-    longLen += y1;
-    for (int j = 0x8000 + (x1 << 16); y1 >= longLen; --y1) {
-      //fb[(j >> 16) + THUMBY_SCREEN_WIDTH * y1] = color;
-      picosystem_write_pixel((j >> 16), y1, color);
-      j -= decInc;
+    for (int32_t y = 0; y < h; y++, row += stride) {
+      color_t *dst = row;
+      for (int32_t x = 0; x < w; x++) {
+        *dst++ = c;
+      }
     }
     return;
   }
 
-  if (longLen > 0) {
-    longLen += x1;
-    for (int j = 0x8000 + (y1 << 16); x1 <= longLen; ++x1) {
-      //fb[x1 + (j >> 16) * THUMBY_SCREEN_WIDTH] = color;
-      picosystem_write_pixel(x1, (j >> 16), color);
-      j += decInc;
+  uint8_t alpha = ctx->alpha;
+  for (int32_t y = 0; y < h; y++, row += stride) {
+    color_t *dst = row;
+    for (int32_t x = 0; x < w; x++, dst++) {
+      *dst = picosystem_blend_pixel(*dst, c, alpha);
+    }
+  }
+}
+
+// lines are walked along their longer axis with the shorter axis held in
+// 16.16 fixed point. the walk is clipped to the context clip rect up front so
+// off-target coordinates cost nothing, and the setup is done in 64 bits so
+// long or far off-target spans can't overflow.
+void picosystem_draw_line(picosystem_ctx_t *ctx, int32_t x1, int32_t y1, int32_t x2, int32_t y2, color_t color)
+{
+  if (ctx->cw <= 0 || ctx->ch <= 0) return;
+
+  int64_t dx = (int64_t)x2 - x1;
+  int64_t dy = (int64_t)y2 - y1;
+  bool yLonger = (dy < 0 ? -dy : dy) > (dx < 0 ? -dx : dx);
+
+  // long axis runs l0 -> l0 + longLen, short axis starts at s0
+  int64_t l0 = yLonger ? y1 : x1;
+  int64_t s0 = yLonger ? x1 : y1;
+  int64_t longLen = yLonger ? dy : dx;
+  int64_t shortLen = yLonger ? dx : dy;
+  int32_t step = longLen < 0 ? -1 : 1;
+  int64_t n = longLen < 0 ? -longLen : longLen;
+  int32_t inc = n == 0 ? 0 : (int32_t)((shortLen * 65536) / n);
+
+  int32_t lmin = yLonger ? ctx->cy : ctx->cx;
+  int32_t lmax = lmin + (yLonger ? ctx->ch : ctx->cw) - 1;
+  int32_t smin = yLonger ? ctx->cx : ctx->cy;
+  int32_t smax = smin + (yLonger ? ctx->cw : ctx->ch) - 1;
+
+  // first and last step of the walk that fall inside the clip on the long axis
+  int64_t k0 = step > 0 ? lmin - l0 : l0 - lmax;
+  int64_t k1 = step > 0 ? lmax - l0 : l0 - lmin;
+  if (k0 < 0) k0 = 0;
+  if (k1 > n) k1 = n;
+  if (k0 > k1) return;
+
+  // the short axis is monotonic so reject if the clipped span misses entirely
+  int64_t j0 = 0x8000 + s0 * 65536 + k0 * inc;
+  int64_t j1 = j0 + (k1 - k0) * inc;
+  int64_t sa = j0 >> 16, sb = j1 >> 16;
+  if ((sa < smin && sb < smin) || (sa > smax && sb > smax)) return;
+
+  // from here on both axes are within a span of the clip rect so 32 bits
+  // are plenty. keep everything the inner loop touches in locals.
+  int32_t stride = ctx->target->w;
+  int32_t lstride = yLonger ? stride : 1;
+  int32_t sstride = yLonger ? 1 : stride;
+  color_t *dst = ctx->target->data + (int32_t)(l0 + k0 * step) * lstride;
+  lstride *= step;
+  int32_t j = (int32_t)j0;
+  bool blend = ctx->blend != PICOSYSTEM_BLEND_COPY;
+  uint8_t alpha = ctx->alpha;
+
+  for (int32_t k = (int32_t)(k1 - k0); k >= 0; k--, dst += lstride, j += inc) {
+    int32_t s = j >> 16;
+    if (s >= smin && s <= smax) {
+      color_t *d = dst + s * sstride;
+      *d = blend ? picosystem_blend_pixel(*d, color, alpha) : color;
+    }
+  }
+}
+
+// copy a w x h rect of src at (sx, sy) to (dx, dy) in the context target,
+// honouring the clip rect and blend state. used to composite offscreen
+// layers back onto the screen. src may be the target itself with
+// overlapping rects (e.g. scrolling a layer in place).
+void picosystem_blit(picosystem_ctx_t *ctx, const buffer_t *src, int32_t sx, int32_t sy, int32_t w, int32_t h, int32_t dx, int32_t dy)
+{
+  // clip against the source buffer
+  if (sx < 0) { w += sx; dx -= sx; sx = 0; }
+  if (sy < 0) { h += sy; dy -= sy; sy = 0; }
+  if (sx + w > src->w) w = src->w - sx;
+  if (sy + h > src->h) h = src->h - sy;
+
+  // clip against the context clip rect
+  if (dx < ctx->cx) { w -= ctx->cx - dx; sx += ctx->cx - dx; dx = ctx->cx; }
+  if (dy < ctx->cy) { h -= ctx->cy - dy; sy += ctx->cy - dy; dy = ctx->cy; }
+  if (dx + w > ctx->cx + ctx->cw) w = ctx->cx + ctx->cw - dx;
+  if (dy + h > ctx->cy + ctx->ch) h = ctx->cy + ctx->ch - dy;
+  if (w <= 0 || h <= 0) return;
+
+  int32_t sstride = src->w, dstride = ctx->target->w;
+  const color_t *srow = src->data + sx + sy * sstride;
+  color_t *drow = ctx->target->data + dx + dy * dstride;
+
+  // when copying within one buffer walk rows bottom up if the destination
+  // is below the source so no row is overwritten before it is read
+  if (src->data == ctx->target->data && drow > srow) {
+    srow += (h - 1) * sstride;
+    drow += (h - 1) * dstride;
+    sstride = -sstride;
+    dstride = -dstride;
+  }
+
+  if (ctx->blend == PICOSYSTEM_BLEND_COPY) {
+    for (int32_t y = 0; y < h; y++, srow += sstride, drow += dstride) {
+      memmove(drow, srow, w * sizeof(color_t));
     }
     return;
   }
-  longLen += x1;
-  for (int j = 0x8000 + (y1 << 16); x1 >= longLen; --x1) {
-    // fb[x1 + (j >> 16) * THUMBY_SCREEN_WIDTH] = color;
-    picosystem_write_pixel(x1, (j >> 16), color);
-    j -= decInc;
+
+  // likewise walk each row right to left if it overlaps to the right
+  uint8_t alpha = ctx->alpha;
+  int32_t xstep = 1;
+  if (src->data == ctx->target->data && drow > srow) {
+    srow += w - 1;
+    drow += w - 1;
+    xstep = -1;
+  }
+  for (int32_t y = 0; y < h; y++, srow += sstride, drow += dstride) {
+    const color_t *s = srow;
+    color_t *d = drow;
+    for (int32_t x = 0; x < w; x++, s += xstep, d += xstep) {
+      *d = picosystem_blend_pixel(*d, *s, alpha);
+    }
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,78 @@
+//
+//  Pimoroni PicoSystem clock/voltage governor policy
+//
+
+#include "picosystem_governor.h"
+
+// known good clock/voltage pairs, slowest first. every clock here can be
+// generated exactly from the 12mhz crystal by set_sys_clock_khz
+const picosystem_clock_preset_t picosystem_clock_presets[] = {
+  { 125000, 1100 },
+  { 150000, 1100 },
+  { 200000, 1150 },
+  { 250000, 1200 },
+};
+const uint8_t picosystem_clock_preset_count =
+  sizeof(picosystem_clock_presets) / sizeof(picosystem_clock_presets[0]);
+
+int8_t picosystem_clock_preset_find(uint32_t khz)
+{
+  for (uint8_t i = 0; i < picosystem_clock_preset_count; i++) {
+    if (picosystem_clock_presets[i].khz == khz) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void picosystem_governor_init(picosystem_governor_t *g, uint32_t budget_us, uint8_t level, uint8_t max_level)
+{
+  if (max_level >= picosystem_clock_preset_count) max_level = picosystem_clock_preset_count - 1;
+  if (level > max_level) level = max_level;
+
+  g->level = level;
+  g->min_level = 0;
+  g->max_level = max_level;
+  g->budget_us = budget_us;
+  g->up_pct = 85;
+  g->down_pct = 65;
+  g->hold_frames = 30;
+  g->calm = 0;
+}
+
+// render time is assumed to scale inversely with the system clock, which
+// holds well enough for cpu bound frames to predict the cost at another level
+static uint32_t picosystem_governor_predict(uint32_t frame_us, uint8_t from, uint8_t to)
+{
+  return frame_us * (picosystem_clock_presets[from].khz / 1000) / (picosystem_clock_presets[to].khz / 1000);
+}
+
+// feed the render time of the last frame, returns the level to run at next.
+// heavy frames step up immediately (straight to the level predicted to fit),
+// light frames must persist for hold_frames before stepping down one level.
+uint8_t picosystem_governor_update(picosystem_governor_t *g, uint32_t frame_us)
+{
+  uint32_t up = g->budget_us * g->up_pct / 100;
+  uint32_t down = g->budget_us * g->down_pct / 100;
+
+  if (frame_us > up) {
+    g->calm = 0;
+    uint8_t l = g->level;
+    while (l < g->max_level && picosystem_governor_predict(frame_us, g->level, l) > up) {
+      l++;
+    }
+    g->level = l;
+    return g->level;
+  }
+
+  if (g->level > g->min_level && picosystem_governor_predict(frame_us, g->level, g->level - 1) < down) {
+    if (++g->calm >= g->hold_frames) {
+      g->calm = 0;
+      g->level--;
+    }
+  } else {
+    g->calm = 0;
+  }
+
+  return g->level;
+}
@@ -0,0 +1,38 @@
+//
+//  Pimoroni PicoSystem clock/voltage governor policy
+//
+//  pure policy with no sdk dependencies so it can be built and fed recorded
+//  frame time traces on a host machine. applying a level to the hardware is
+//  done by picosystem_governor_frame() in picosystem_hardware.c
+//
+
+#ifndef PICOSYSTEM_GOVERNOR_H
+#define PICOSYSTEM_GOVERNOR_H
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+  uint32_t khz;   // system clock
+  uint16_t mv;    // core voltage
+} picosystem_clock_preset_t;
+
+extern const picosystem_clock_preset_t picosystem_clock_presets[];
+extern const uint8_t picosystem_clock_preset_count;
+
+typedef struct {
+  uint8_t level;        // current index into picosystem_clock_presets
+  uint8_t min_level, max_level;
+  uint32_t budget_us;   // frame time available per vsync
+  uint8_t up_pct;       // step up when frame time exceeds this % of budget
+  uint8_t down_pct;     // step down when predicted time at the lower level is under this % of budget
+  uint8_t hold_frames;  // consecutive light frames needed before stepping down
+  uint8_t calm;         // light frames seen so far
+} picosystem_governor_t;
+
+void picosystem_governor_init(picosystem_governor_t *g, uint32_t budget_us, uint8_t level, uint8_t max_level);
+uint8_t picosystem_governor_update(picosystem_governor_t *g, uint32_t frame_us);
+int8_t picosystem_clock_preset_find(uint32_t khz);
+
+#endif // PICOSYSTEM_GOVERNOR_H
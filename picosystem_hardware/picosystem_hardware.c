@@ -16,6 +16,30 @@
 
 volatile struct picosystem_hw pshw;
 color_t _fb[PICOSYSTEM_SCREEN_WIDTH * PICOSYSTEM_SCREEN_HEIGHT] __attribute__ ((aligned (4))) = { };
+picosystem_ctx_t _screen_ctx;
+
+// adc samples are streamed into this ring by dma, it must be aligned to its
+// size in bytes for the dma ring wrap to work
+#define PICOSYSTEM_ADC_SAMPLES      16
+#define PICOSYSTEM_ADC_RING_BITS    5    // log2(sizeof(_adc_samples))
+#define PICOSYSTEM_BATTERY_HYST_MV  100  // rise needed to re-arm low battery callback
+uint16_t _adc_samples[PICOSYSTEM_ADC_SAMPLES] __attribute__ ((aligned (32))) = { };
+repeating_timer_t _battery_timer;
+
+// pwm slices are divided so they tick as they would at this clock, keeping
+// backlight and led frequencies stable across clock changes
+#define PICOSYSTEM_PWM_REF_KHZ      125000
+// max st7789 spi clock is 62.5mhz and the screen pio program emits one sck
+// edge per instruction, so the pio must never run faster than twice that.
+// the divider is rounded up to an integer - a fractional divider dithers
+// between whole cycle counts and would produce some sck edges above the
+// limit - so flip time varies by preset (125mhz and 250mhz run the pio at
+// exactly 125mhz, 150mhz and 200mhz at 75mhz and 100mhz)
+#define PICOSYSTEM_SCREEN_PIO_KHZ   125000
+#define PICOSYSTEM_AUDIO_PWM_WRAP   5000
+#define PICOSYSTEM_VREG_SETTLE_US   1000
+picosystem_governor_t _governor;
+bool _governor_enabled = false;
 
 buffer_t* picosystem_alloc_buffer(uint32_t w, uint32_t h, void *data)
 {
@@ -32,6 +56,20 @@ buffer_t* picosystem_alloc_buffer(uint32_t w, uint32_t h, void *data)
   return b;
 }
 
+void picosystem_free_buffer(buffer_t *b)
+{
+  if (b->alloc) {
+    free(b->data);
+  }
+  free(b);
+}
+
+// default context targeting the display framebuffer
+picosystem_ctx_t* picosystem_screen_ctx()
+{
+  return &_screen_ctx;
+}
+
 void picosystem_init_inputs(uint32_t pin_mask)
 {
   for (uint8_t i = 0; i < 32; i++) {
@@ -76,12 +114,103 @@ void picosytem_reset_to_dfu()
   reset_usb_boot(0, 0);
 }
 
+// the battery level is sampled in the background: the adc runs free into
+// its fifo, dma copies each conversion into a small ring and a repeating
+// timer averages the ring into a filtered fixed-point level. reading the
+// level is then just a load.
+bool picosystem_battery_sample(repeating_timer_t *rt)
+{
+  // restart the dma stream if it has run out of transfers
+  if (!dma_channel_is_busy(pshw.adc_dma_channel)) {
+    dma_channel_set_trans_count(pshw.adc_dma_channel, 0xffffffff, true);
+  }
+
+  uint32_t sum = 0;
+  for (int i = 0; i < PICOSYSTEM_ADC_SAMPLES; i++) {
+    sum += _adc_samples[i];
+  }
+
+  // average of 16 12-bit samples * 3.3v * 3 for the divider on board, in mV
+  int32_t mv16 = (int32_t)((sum * 9900) >> 12);
+
+  pshw.battery_filt += (mv16 - pshw.battery_filt) >> 3;
+  pshw.battery_mv = (uint16_t)(pshw.battery_filt >> 4);
+  pshw.charging = gpio_get(PICOSYSTEM_PIN_CHARGING);
+
+  if (pshw.battery_callback) {
+    if (!pshw.battery_low && pshw.battery_mv < pshw.battery_low_mv) {
+      pshw.battery_low = true;
+      pshw.battery_callback(pshw.battery_mv, pshw.charging);
+    } else if (pshw.battery_low && pshw.battery_mv > pshw.battery_low_mv + PICOSYSTEM_BATTERY_HYST_MV) {
+      pshw.battery_low = false;
+    }
+  }
+
+  return true;
+}
+
+void picosystem_battery_init()
+{
+  gpio_init(PICOSYSTEM_PIN_CHARGING);
+  gpio_set_dir(PICOSYSTEM_PIN_CHARGING, GPIO_IN);
+
+  // take one blocking reading to seed the ring and the filter so the level
+  // is valid straight away rather than after the first timer tick
+  adc_select_input(PICOSYSTEM_PIN_BATTERY_LEVEL - 26);
+  uint16_t raw = adc_read();
+  for (int i = 0; i < PICOSYSTEM_ADC_SAMPLES; i++) {
+    _adc_samples[i] = raw;
+  }
+  pshw.battery_filt = (int32_t)((raw * PICOSYSTEM_ADC_SAMPLES * 9900) >> 12);
+  pshw.battery_mv = (uint16_t)(pshw.battery_filt >> 4);
+  pshw.charging = gpio_get(PICOSYSTEM_PIN_CHARGING);
+  pshw.battery_low = false;
+
+  // free-running conversions at ~1khz (48mhz adc clock / 48000) into the
+  // fifo, raising dreq for every sample
+  adc_fifo_setup(true, true, 1, false, false);
+  adc_set_clkdiv(47999);
+
+  pshw.adc_dma_channel = dma_claim_unused_channel(true);
+  dma_channel_config config = dma_channel_get_default_config(pshw.adc_dma_channel);
+  channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+  channel_config_set_read_increment(&config, false);
+  channel_config_set_write_increment(&config, true);
+  channel_config_set_ring(&config, true, PICOSYSTEM_ADC_RING_BITS);
+  channel_config_set_dreq(&config, DREQ_ADC);
+  dma_channel_configure(
+    pshw.adc_dma_channel, &config, _adc_samples, &adc_hw->fifo, 0xffffffff, true);
+
+  adc_run(true);
+
+  add_repeating_timer_ms(-100, picosystem_battery_sample, NULL, &_battery_timer);
+}
+
 float picosystem_battery_voltage() 
 {
-  // convert adc reading to voltage
-  adc_select_input(0);
-  float v = ((float)adc_read() / (1 << 12)) * 3.3f;
-  return v * 3.0f; // correct for voltage divider on board
+  return (float)pshw.battery_mv / 1000.0f;
+}
+
+uint16_t picosystem_battery_mv()
+{
+  return pshw.battery_mv;
+}
+
+bool picosystem_battery_charging()
+{
+  return pshw.charging;
+}
+
+// callback is invoked from the sampling timer irq once the filtered level
+// drops below low_mv, and re-armed once it recovers. pass NULL to disable.
+void picosystem_battery_callback(uint16_t low_mv, picosystem_battery_callback_t callback)
+{
+  // keep the sampling irq from seeing a half updated threshold/callback pair
+  uint32_t irq = save_and_disable_interrupts();
+  pshw.battery_low_mv = low_mv;
+  pshw.battery_low = false;
+  pshw.battery_callback = callback;
+  restore_interrupts(irq);
 }
 
 uint32_t picosystem_time()
@@ -225,17 +354,28 @@ void picosystem_backlight(uint8_t b) {
   pwm_set_gpio_level(PICOSYSTEM_PIN_BACKLIGHT, picosystem_gamma_correct(b));
 }
 
+// play a tone of f hz at volume v (0..100), f or v of zero silences it
 void picosystem_play_note(uint32_t f, uint32_t v) {
-  // adjust the clock divider to achieve this desired frequency
-  #ifndef NO_OVERCLOCK
-    float clock = 250000000.0f;
-  #else
-    float clock = 125000000.0f;
-  #endif
+  uint slice = pwm_gpio_to_slice_num(PICOSYSTEM_PIN_AUDIO);
 
-  // float pwm_divider = clock / _audio_pwm_wrap / f;
-  // pwm_set_clkdiv(pwm_gpio_to_slice_num(AUDIO), pwm_divider);
-  // pwm_set_wrap(pwm_gpio_to_slice_num(AUDIO), _audio_pwm_wrap);
+  // remembered so the note can be re-derived after a clock change
+  pshw.audio_f = f;
+  pshw.audio_v = v;
+
+  if (f == 0 || v == 0) {
+    pwm_set_gpio_level(PICOSYSTEM_PIN_AUDIO, 0);
+    return;
+  }
+
+  // adjust the clock divider to achieve this desired frequency. the system
+  // clock can be changed at runtime by the governor so read it live
+  float clock = (float)clock_get_hz(clk_sys);
+
+  float pwm_divider = clock / PICOSYSTEM_AUDIO_PWM_WRAP / f;
+  if (pwm_divider < 1.0f) pwm_divider = 1.0f;
+  if (pwm_divider > 255.9375f) pwm_divider = 255.9375f;
+  pwm_set_clkdiv(slice, pwm_divider);
+  pwm_set_wrap(slice, PICOSYSTEM_AUDIO_PWM_WRAP);
 
   // work out usable range of volumes at this frequency. the piezo speaker
   // isn't driven in a way that can control volume easily however if we're
@@ -246,12 +386,13 @@ void picosystem_play_note(uint32_t f, uint32_t v) {
   // the piezo to between 0 and 1/10000th of a second gives reasonable control
   // over the volume. the relationship is non linear so we also apply a
   // correction curve which is tuned so that the result sounds reasonable.
-  // uint32_t max_count = (f * _audio_pwm_wrap) / 10000;
+  uint32_t max_count = (f * PICOSYSTEM_AUDIO_PWM_WRAP) / 10000;
+  if (max_count > PICOSYSTEM_AUDIO_PWM_WRAP) max_count = PICOSYSTEM_AUDIO_PWM_WRAP;
 
   // the change in volume isn't linear - we correct for this here
-  // float curve = 1.8f;
-  // uint32_t level = (pow((float)(v) / 100.0f, curve) * max_count);
-  // pwm_set_gpio_level(AUDIO, level);
+  float curve = 1.8f;
+  uint32_t level = (pow((float)(v) / 100.0f, curve) * max_count);
+  pwm_set_gpio_level(PICOSYSTEM_PIN_AUDIO, level);
 }
 
 void picosystem_led(uint8_t r, uint8_t g, uint8_t b) {
@@ -275,6 +416,101 @@ uint32_t picosystem_gpio_get() {
   return gpio_get_all();
 }
 
+static enum vreg_voltage picosystem_vreg_from_mv(uint16_t mv) {
+  switch(mv) {
+    case 1150: return VREG_VOLTAGE_1_15;
+    case 1200: return VREG_VOLTAGE_1_20;
+    default:   return VREG_VOLTAGE_1_10;
+  }
+}
+
+// bring everything clocked from clk_sys back in line after a clock change
+void picosystem_retime_peripherals(uint32_t khz) {
+  uint32_t div = (khz + PICOSYSTEM_SCREEN_PIO_KHZ - 1) / PICOSYSTEM_SCREEN_PIO_KHZ;
+  pio_sm_set_clkdiv_int_frac(pshw.screen_pio, pshw.screen_sm, div, 0);
+
+  // backlight and led pins share slices, so collect the slices first and
+  // divide each once
+  uint32_t slices =
+    (1u << pwm_gpio_to_slice_num(PICOSYSTEM_PIN_BACKLIGHT)) |
+    (1u << pwm_gpio_to_slice_num(PICOSYSTEM_PIN_RED)) |
+    (1u << pwm_gpio_to_slice_num(PICOSYSTEM_PIN_GREEN)) |
+    (1u << pwm_gpio_to_slice_num(PICOSYSTEM_PIN_BLUE));
+
+  // a playing note has its own divider derived from the live clock,
+  // otherwise the audio slice is scaled like the others
+  if (pshw.audio_f != 0 && pshw.audio_v != 0) {
+    picosystem_play_note(pshw.audio_f, pshw.audio_v);
+  } else {
+    slices |= 1u << pwm_gpio_to_slice_num(PICOSYSTEM_PIN_AUDIO);
+  }
+
+  uint32_t div16 = khz * 16 / PICOSYSTEM_PWM_REF_KHZ;
+  for (uint slice = 0; slice < NUM_PWM_SLICES; slice++) {
+    if (slices & (1u << slice)) {
+      pwm_set_clkdiv_int_frac(slice, div16 >> 4, div16 & 0xf);
+    }
+  }
+
+  // clk_peri follows clk_sys so the uart baud divisor must be recomputed
+  #ifdef uart_default
+    uart_set_baudrate(uart_default, PICO_DEFAULT_UART_BAUD_RATE);
+  #endif
+}
+
+// switch to one of picosystem_clock_presets. voltage is raised before
+// speeding up and lowered after slowing down so the core is never
+// undervolted for its clock. force retimes the peripherals even when the
+// clock already matches, replacing whatever dividers were set at boot.
+void picosystem_set_clock_preset(uint8_t level, bool force) {
+  if (level >= picosystem_clock_preset_count) level = picosystem_clock_preset_count - 1;
+  const picosystem_clock_preset_t *p = &picosystem_clock_presets[level];
+  uint32_t khz = clock_get_hz(clk_sys) / 1000;
+  if (khz == p->khz && !force) return;
+
+  // don't retime the screen pio in the middle of a transfer
+  while(picosystem_is_flipping()) {}
+
+  if (p->khz > khz) {
+    vreg_set_voltage(picosystem_vreg_from_mv(p->mv));
+    busy_wait_us(PICOSYSTEM_VREG_SETTLE_US);
+    set_sys_clock_khz(p->khz, true);
+  } else if (p->khz < khz) {
+    set_sys_clock_khz(p->khz, true);
+    vreg_set_voltage(picosystem_vreg_from_mv(p->mv));
+  } else {
+    vreg_set_voltage(picosystem_vreg_from_mv(p->mv));
+  }
+
+  picosystem_retime_peripherals(p->khz);
+}
+
+// budget_us is the frame time available per vsync, max_level caps the
+// preset the governor may select
+void picosystem_governor_enable(uint32_t budget_us, uint8_t max_level) {
+  int8_t level = picosystem_clock_preset_find(clock_get_hz(clk_sys) / 1000);
+  picosystem_governor_init(&_governor, budget_us, level < 0 ? max_level : level, max_level);
+  // force so the dividers left over from boot are replaced and a preset
+  // always scans out at the same speed
+  picosystem_set_clock_preset(_governor.level, true);
+  _governor_enabled = true;
+}
+
+void picosystem_governor_disable() {
+  _governor_enabled = false;
+}
+
+// call once per frame with the measured render time (excluding time spent
+// waiting for vsync or the previous flip)
+void picosystem_governor_frame(uint32_t frame_us) {
+  if (!_governor_enabled) return;
+
+  uint8_t level = _governor.level;
+  if (picosystem_governor_update(&_governor, frame_us) != level) {
+    picosystem_set_clock_preset(_governor.level, false);
+  }
+}
+
 void picosystem_init_hardware() {
   // configure backlight pwm and disable backlight while setting up
   pwm_config cfg = pwm_get_default_config();
@@ -304,8 +540,10 @@ void picosystem_init_hardware() {
     PICOSYSTEM_INPUT_RIGHT);
   picosystem_init_outputs(PICOSYSTEM_PIN_CHARGE_LED);
 
-  // configure adc channel used to monitor battery charge
+  // configure adc channel used to monitor battery charge and start
+  // sampling it in the background
   adc_init(); adc_gpio_init(PICOSYSTEM_PIN_BATTERY_LEVEL);
+  picosystem_battery_init();
 
   // configure pwm channels for red, green, blue led channels
   pwm_set_wrap(pwm_gpio_to_slice_num(PICOSYSTEM_PIN_RED), 65535);
@@ -424,16 +662,19 @@ void picosystem_init()
   pshw.dma_scanline = -1;
 
   pshw.screen = picosystem_alloc_buffer(120, 120, _fb);
-  pshw.cx = 0;
-  pshw.cy = 0;
-  pshw.cw = 120;
-  pshw.ch = 120;
+  picosystem_ctx_init(&_screen_ctx, pshw.screen);
 
   pshw.io = 0;
   pshw.lio = 0;
 
   pshw.in_flip = false;
 
+  pshw.audio_f = 0;
+  pshw.audio_v = 0;
+
+  pshw.battery_low_mv = 0;
+  pshw.battery_callback = NULL;
+
   picosystem_init_hardware();
 }
 
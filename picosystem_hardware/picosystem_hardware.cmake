@@ -6,13 +6,14 @@ pico_generate_pio_header(picosystem_hardware ${CMAKE_CURRENT_LIST_DIR}/screen_do
 target_sources(picosystem_hardware INTERFACE
   ${CMAKE_CURRENT_LIST_DIR}/picosystem_hardware.c
   ${CMAKE_CURRENT_LIST_DIR}/picosystem_draw.c
+  ${CMAKE_CURRENT_LIST_DIR}/picosystem_governor.c
 )
 
 set(picosystem_hardware_LINKER_SCRIPT ${CMAKE_CURRENT_LIST_DIR}/memmap_picosystem.ld)
 
 target_include_directories(picosystem_hardware INTERFACE ${CMAKE_CURRENT_LIST_DIR})
 
-target_link_libraries(picosystem_hardware INTERFACE pico_stdlib hardware_pio hardware_spi hardware_pwm hardware_dma hardware_irq hardware_adc hardware_interp)
+target_link_libraries(picosystem_hardware INTERFACE pico_stdlib hardware_pio hardware_spi hardware_pwm hardware_dma hardware_irq hardware_adc hardware_interp hardware_clocks hardware_vreg)
 
 # function(picosystem_hardware_executable NAME SOURCES)
 
@@ -25,6 +25,7 @@
 #include "hardware/pio.h"
 #include "hardware/irq.h"
 #include "hardware/vreg.h"
+#include "hardware/clocks.h"
 
 #include "pico/bootrom.h"
 #include "pico/stdlib.h"
@@ -32,6 +33,8 @@
 
 #include "pico/stdlib.h"
 
+#include "picosystem_governor.h"
+
 #define PIXEL_DOUBLE
 
 #ifdef PIXEL_DOUBLE
@@ -49,17 +52,46 @@ typedef struct {
   bool alloc;
 } buffer_t;
 
+enum PICOSYSTEM_BLEND {
+  PICOSYSTEM_BLEND_COPY,  // overwrite destination
+  PICOSYSTEM_BLEND_ALPHA  // mix by source alpha scaled by context alpha
+};
+
+// render context: every drawing primitive writes through one of these so
+// that the same code can target the screen, an offscreen buffer or a
+// per-core layer. contexts are plain memory - the hot loops copy what they
+// need into locals rather than reloading shared hardware state.
+typedef struct {
+  buffer_t *target;
+  int32_t cx, cy, cw, ch; // clip rect
+  uint8_t blend;          // PICOSYSTEM_BLEND_*
+  uint8_t alpha;          // global alpha 0..15
+} picosystem_ctx_t;
+
+typedef void (*picosystem_battery_callback_t)(uint16_t mv, bool charging);
+
 struct picosystem_hw {
   PIO screen_pio;
   uint screen_sm;
   uint32_t dma_channel;
   volatile int16_t dma_scanline;
   buffer_t *screen;
-  int32_t cx, cy, cw, ch;
   uint32_t io, lio; // input, last input
   bool in_flip;
+  uint32_t audio_f, audio_v; // current note, replayed after clock changes
+
+  // battery sampler state, updated from the sampling timer irq
+  uint32_t adc_dma_channel;
+  int32_t battery_filt;   // filtered level in 1/16 mV
+  uint16_t battery_mv;    // filtered level in mV
+  bool charging;
+  uint16_t battery_low_mv;
+  bool battery_low;
+  picosystem_battery_callback_t battery_callback;
 };
 
+extern volatile struct picosystem_hw pshw;
+
 enum PICOSYSTEM_PIN {
   PICOSYSTEM_PIN_RED = 14, PICOSYSTEM_PIN_GREEN = 13, PICOSYSTEM_PIN_BLUE = 15,                  // user rgb led
   PICOSYSTEM_PIN_CS = 5, PICOSYSTEM_PIN_SCK = 6, PICOSYSTEM_PIN_MOSI  = 7,                       // spi
@@ -85,12 +117,38 @@ void picosystem_init();
 // void picosystem_draw(uint32_t tick);
 void picosystem_backlight(uint8_t brightness);
 void picosystem_led(uint8_t r, uint8_t g, uint8_t b);
+void picosystem_play_note(uint32_t f, uint32_t v);
+float picosystem_battery_voltage();
+uint16_t picosystem_battery_mv();
+bool picosystem_battery_charging();
+void picosystem_battery_callback(uint16_t low_mv, picosystem_battery_callback_t callback);
+void picosystem_set_clock_preset(uint8_t level, bool force);
+void picosystem_governor_enable(uint32_t budget_us, uint8_t max_level);
+void picosystem_governor_disable();
+void picosystem_governor_frame(uint32_t frame_us);
 // void picosystem_audio(uint8_t left, uint8_t right);
 
+buffer_t* picosystem_alloc_buffer(uint32_t w, uint32_t h, void *data);
+void picosystem_free_buffer(buffer_t *b);
+
+picosystem_ctx_t* picosystem_screen_ctx();
+void picosystem_ctx_init(picosystem_ctx_t *ctx, buffer_t *target);
+void picosystem_ctx_clip(picosystem_ctx_t *ctx, int32_t x, int32_t y, int32_t w, int32_t h);
+void picosystem_ctx_blend(picosystem_ctx_t *ctx, uint8_t blend, uint8_t alpha);
+
 color_t picosystem_rgb(uint8_t r, uint8_t g, uint8_t b, uint8_t a);
-void picosystem_clear(color_t c);
-void picosystem_draw_line(color_t *fb, int32_t x0, int32_t y0, int32_t x1, int32_t y1, color_t c);
-inline void picosystem_write_pixel(int32_t x, int32_t y, color_t c);
+color_t picosystem_blend_pixel(color_t dst, color_t src, uint8_t alpha);
+void picosystem_clear(picosystem_ctx_t *ctx, color_t c);
+void picosystem_draw_line(picosystem_ctx_t *ctx, int32_t x0, int32_t y0, int32_t x1, int32_t y1, color_t c);
+void picosystem_blit(picosystem_ctx_t *ctx, const buffer_t *src, int32_t sx, int32_t sy, int32_t w, int32_t h, int32_t dx, int32_t dy);
+
+// single pixel write honouring the context clip rect and blend state. for
+// runs of pixels prefer the primitives above which hoist the setup.
+static inline void picosystem_write_pixel(picosystem_ctx_t *ctx, int32_t x, int32_t y, color_t c) {
+  if (x < ctx->cx || y < ctx->cy || x >= ctx->cx + ctx->cw || y >= ctx->cy + ctx->ch) return;
+  color_t *dst = &ctx->target->data[x + y * ctx->target->w];
+  *dst = ctx->blend == PICOSYSTEM_BLEND_COPY ? c : picosystem_blend_pixel(*dst, c, ctx->alpha);
+}
 
 uint32_t picosystem_time();
 uint32_t picosystem_time_us();
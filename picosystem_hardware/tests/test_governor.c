@@ -0,0 +1,106 @@
+//
+//  Pimoroni PicoSystem clock/voltage governor policy - host test
+//
+//  replays a recorded frame time trace through the governor policy and
+//  checks the level it picks after every frame. build on the host with
+//  the CMakeLists.txt in this directory, no pico sdk needed.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "picosystem_governor.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+  if (!(cond)) { \
+    printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+    printf(__VA_ARGS__); \
+    printf("\n"); \
+    failures++; \
+  } \
+} while (0)
+
+// trace lines are "<render us at 125mhz> <expected level>", '#' starts a comment
+static void test_trace(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  CHECK(f != NULL, "can't open trace %s", path);
+  if (!f) return;
+
+  picosystem_governor_t g;
+  picosystem_governor_init(&g, 25000, 0, 3);
+
+  char line[256];
+  int frame = 0;
+  while (fgets(line, sizeof(line), f)) {
+    unsigned cost_us, expected;
+    if (line[0] == '#' || sscanf(line, "%u %u", &cost_us, &expected) != 2) continue;
+
+    // render time scales inversely with the clock of the current preset
+    uint32_t frame_us = cost_us * 125 / (picosystem_clock_presets[g.level].khz / 1000);
+    uint8_t before = g.level;
+    uint8_t level = picosystem_governor_update(&g, frame_us);
+
+    CHECK(level == expected, "frame %d: %uus at level %u -> %u, expected %u",
+      frame, (unsigned)frame_us, before, level, expected);
+    CHECK(level <= g.max_level, "frame %d: level %u above max", frame, level);
+    CHECK(level >= before - 1, "frame %d: stepped down more than one level", frame);
+    frame++;
+  }
+  fclose(f);
+
+  CHECK(frame > 0, "trace %s has no frames", path);
+}
+
+static void test_max_level()
+{
+  picosystem_governor_t g;
+  picosystem_governor_init(&g, 25000, 0, 1);
+  CHECK(picosystem_governor_update(&g, 100000) == 1, "heavy frame should stop at max level");
+  CHECK(picosystem_governor_update(&g, 100000) == 1, "level must not exceed max level");
+
+  picosystem_governor_init(&g, 25000, 9, 9);
+  CHECK(g.max_level == picosystem_clock_preset_count - 1, "max level clamped to preset count");
+  CHECK(g.level == g.max_level, "start level clamped to max level");
+}
+
+static void test_hold()
+{
+  picosystem_governor_t g;
+  picosystem_governor_init(&g, 25000, 3, 3);
+
+  // light frames must persist for hold_frames before stepping down, and a
+  // single frame over the down threshold restarts the count
+  for (int i = 0; i < g.hold_frames - 1; i++) {
+    CHECK(picosystem_governor_update(&g, 1000) == 3, "stepped down before hold at frame %d", i);
+  }
+  CHECK(picosystem_governor_update(&g, 15000) == 3, "mid load frame should not change level");
+  for (int i = 0; i < g.hold_frames - 1; i++) {
+    CHECK(picosystem_governor_update(&g, 1000) == 3, "hold not reset at frame %d", i);
+  }
+  CHECK(picosystem_governor_update(&g, 1000) == 2, "should step down one level after hold");
+}
+
+static void test_preset_find()
+{
+  CHECK(picosystem_clock_preset_find(125000) == 0, "125mhz is preset 0");
+  CHECK(picosystem_clock_preset_find(250000) == picosystem_clock_preset_count - 1, "250mhz is the top preset");
+  CHECK(picosystem_clock_preset_find(133000) == -1, "133mhz is not a preset");
+}
+
+int main(int argc, char **argv)
+{
+  test_trace(argc > 1 ? argv[1] : "governor_trace.txt");
+  test_max_level();
+  test_hold();
+  test_preset_find();
+
+  if (failures) {
+    printf("%d check(s) failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("all governor checks passed\n");
+  return EXIT_SUCCESS;
+}